@@ -3,6 +3,8 @@
 #include <boost/asio.hpp>
 
 #include "metrics.h"
+#include "replication.h"
+#include "compression.h"
 
 // Travis do not have it
 template<typename T, typename... Args>
@@ -25,19 +27,24 @@ class CommandState
 {
 public:
     Metrics& _m;
+    Replication& _r;
     std::map<size_t, std::string>& _a;
     std::map<size_t, std::string>& _b;
 
     boost::asio::ip::tcp::socket& _socket;
     boost::asio::io_service::strand& _strand;
 
+    ResultStream& _out;
+
     CommandState(
         Metrics& m,
+        Replication& r,
         std::map<size_t, std::string>& a,
         std::map<size_t, std::string>& b,
         boost::asio::ip::tcp::socket& socket,
-        boost::asio::io_service::strand& strand
-    ) : _m(m), _a(a), _b(b), _socket(socket), _strand(strand)
+        boost::asio::io_service::strand& strand,
+        ResultStream& out
+    ) : _m(m), _r(r), _a(a), _b(b), _socket(socket), _strand(strand), _out(out)
     {
     }
 };
@@ -65,7 +72,9 @@ public:
     virtual std::string name() final { return "INSERT"; }
     virtual std::string validate(std::vector<std::string>& tokens) final {
         std::string response;
-        if(tokens.size() < 4)
+        if(!_s._r.leader())
+            response = "ERR read-only follower";
+        else if(tokens.size() < 4)
             response = "ERR not enough arguments for insert";
         else
         {
@@ -86,6 +95,7 @@ public:
         if(f == r.end())
         {
             r[id] = tokens[3];
+            _s._r.publish(name() + " " + tokens[1] + " " + tokens[2] + " " + tokens[3]);
             _s._m.update("session.successes." + name(), 1);
             _s._m.update("session.successes."+tokens[1]+"."+name(), 1);
         } else
@@ -106,7 +116,9 @@ public:
     virtual std::string name() final { return "TRUNCATE"; }
     virtual std::string validate(std::vector<std::string>& tokens) final {
         std::string response;
-        if(tokens.size() < 2)
+        if(!_s._r.leader())
+            response = "ERR read-only follower";
+        else if(tokens.size() < 2)
             response = "ERR not enough arguments for truncate";
         else
         {
@@ -135,6 +147,10 @@ public:
             }
         }
 
+        // published once table is empty, so inserts that raced with truncation are dropped on followers too
+        if(response.empty())
+            _s._r.publish(name() + " " + tokens[1]);
+
         return std::move(response);
     }
 };
@@ -179,7 +195,7 @@ public:
                 _s._strand.post(yield[ec]);
             else {
                 line += "\n";
-                boost::asio::async_write(_s._socket, boost::asio::buffer(line.c_str(), line.length()), yield[ec]);
+                _s._out.write(line, yield, ec);
             }
 
             if(ec) {
@@ -188,26 +204,34 @@ public:
                 break;
             }
 
-            it_a = has_a ? _s._a.find(cur_a) : _s._a.end();
-            it_b = has_b ? _s._b.find(cur_b) : _s._b.end();
-
-            if(has_a && has_b)
-                if(cur_a == cur_b) {
-                    ++it_a;
-                    ++it_b;
-                } else if(cur_a < cur_b)
-                    ++it_a;
-                else
-                    ++it_b;
-            else if(has_a)
-                ++it_a;
+            // records may be gone after yield, so seek by id instead of stepping from find()
+            bool next_a = has_a && (!has_b || cur_a <= cur_b);
+            bool next_b = has_b && (!has_a || cur_b <= cur_a);
+
+            if(!has_a)
+                it_a = _s._a.end();
+            else if(next_a)
+                it_a = _s._a.upper_bound(cur_a);
             else
-                ++it_b;
+                it_a = _s._a.lower_bound(cur_a);
+
+            if(!has_b)
+                it_b = _s._b.end();
+            else if(next_b)
+                it_b = _s._b.upper_bound(cur_b);
+            else
+                it_b = _s._b.lower_bound(cur_b);
 
             has_a = it_a != _s._a.end();
             has_b = it_b != _s._b.end();
         }
 
+        _s._out.flush(yield, ec);
+        if(ec && response.empty()) {
+            response = "session error";
+            std::cerr << "session error: " << ec << std::endl;
+        }
+
         return std::move(response);
     }
 };
@@ -266,7 +290,9 @@ public:
     virtual std::string name() final { return "REMOVE"; }
     virtual std::string validate(std::vector<std::string>& tokens) final {
         std::string response;
-        if(tokens.size() < 3)
+        if(!_s._r.leader())
+            response = "ERR read-only follower";
+        else if(tokens.size() < 3)
             response = "ERR not enough arguments for remove";
         else
         {
@@ -287,6 +313,7 @@ public:
         if(f != r.end())
         {
             r.erase(f);
+            _s._r.publish(name() + " " + tokens[1] + " " + tokens[2]);
             _s._m.update("session.successes." + name(), 1);
             _s._m.update("session.successes."+tokens[1]+"."+name(), 1);
         } else
@@ -332,17 +359,196 @@ public:
         {
             size_t id = it->first;
             line = std::to_string(id) + "\t" + it->second + "\n";
-            boost::asio::async_write(_s._socket, boost::asio::buffer(line.c_str(), line.length()), yield[ec]);
+            _s._out.write(line, yield, ec);
+
+            if(ec) {
+                response = "session error";
+                std::cerr << "session error: " << ec << std::endl;
+                break;
+            }
+
+            // record may be gone after yield, so continue from the next id rather than find(id)
+            it = r.upper_bound(id);
+        }
+
+        _s._out.flush(yield, ec);
+        if(ec && response.empty()) {
+            response = "session error";
+            std::cerr << "session error: " << ec << std::endl;
+        }
+
+        return std::move(response);
+    }
+};
+
+class CReplicate : public Command
+{
+private:
+    CommandState _s;
+
+    static const size_t chunk_size = 64 * 1024;
+
+    bool write(std::string& chunk, std::string& response, boost::asio::yield_context& yield)
+    {
+        boost::system::error_code ec;
+        boost::asio::async_write(_s._socket, boost::asio::buffer(chunk.c_str(), chunk.length()), yield[ec]);
+        chunk.clear();
+        if(ec) {
+            response = "session error";
+            std::cerr << "session error: " << ec << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    CReplicate(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final { return "REPLICATE"; }
+    virtual std::string validate(std::vector<std::string>& tokens) final {
+        std::string response;
+        if(!_s._r.leader())
+            response = "ERR not a leader";
+        else if(_s._r.stopped())
+            response = "ERR server is stopping";
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+
+        // Changes are queued from the moment of subscription while snapshot is read from live tables.
+        // Rows changed behind the cursor are fixed by the queued changes, rows ahead of it are
+        // read already changed, and replaying them again on follower is harmless.
+        ReplicationFeed feed(_s._socket.get_io_service());
+        size_t seq = _s._r.subscribe(feed);
+
+        std::string chunk = _s._r.line(seq, "SNAPSHOT");
+        for(auto& t : { std::make_pair("A", &_s._a), std::make_pair("B", &_s._b) }) {
+            std::string prefix = std::string("INSERT ") + t.first + " ";
+            std::map<size_t, std::string>& r = *t.second;
+            auto it = r.begin();
+            while(it != r.end()) {
+                size_t id = it->first;
+                chunk += _s._r.line(seq, prefix + std::to_string(id) + " " + it->second);
+                if(chunk.length() >= chunk_size && !write(chunk, response, yield))
+                    break;
+                // record may be gone after yield, so continue from the next id rather than find(id)
+                it = r.upper_bound(id);
+            }
+            if(!response.empty())
+                break;
+        }
+        chunk += _s._r.line(seq, "SYNC");
+
+        boost::system::error_code ec;
+        while(response.empty() && write(chunk, response, yield)) {
+            if(_s._r.stopped())
+                break;
+
+            if(feed._overflow) {
+                _s._m.update("replication.overflows", 1);
+                response = "ERR follower is too far behind";
+                break;
+            }
+
+            if(feed._queue.empty()) {
+                feed._timer.expires_from_now(std::chrono::seconds(1));
+                feed._timer.async_wait(yield[ec]);
+                if(feed._queue.empty())
+                    feed._queue.push_back(_s._r.line("PING"));
+            }
+
+            while(!feed._queue.empty() && chunk.length() < chunk_size) {
+                chunk += feed._queue.front();
+                feed._queue.pop_front();
+            }
+        }
+
+        _s._r.unsubscribe(feed);
 
+        // connection is dedicated to the stream: stop reading, so session ends right after
+        // follower receives response line, which marks the end of stream
+        _s._socket.shutdown(boost::asio::ip::tcp::socket::shutdown_receive, ec);
+
+        return std::move(response);
+    }
+};
+
+class CReplication : public Command
+{
+private:
+    CommandState _s;
+
+public:
+    CReplication(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final { return "REPLICATION"; }
+    virtual std::string validate(std::vector<std::string>& tokens) final {
+        std::string response;
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+
+        boost::system::error_code ec;
+        for(auto& l : _s._r.status())
+        {
+            boost::asio::async_write(_s._socket, boost::asio::buffer(l.c_str(), l.length()), yield[ec]);
             if(ec) {
                 response = "session error";
                 std::cerr << "session error: " << ec << std::endl;
                 break;
             }
+        }
 
-            it = r.find(id);
-            ++it;
+        return std::move(response);
+    }
+};
+
+class CSet : public Command
+{
+private:
+    CommandState _s;
+
+public:
+    CSet(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final { return "SET"; }
+    virtual std::string validate(std::vector<std::string>& tokens) final {
+        std::string response;
+        if(tokens.size() < 3)
+            response = "ERR not enough arguments for set";
+        else
+        {
+            boost::to_upper(tokens[1]);
+            boost::to_lower(tokens[2]);
+            if(tokens[1] == "COMPRESSION") {
+                if(tokens[2] != "none" && !_s._out.compressor().codec(tokens[2]))
+                    response = "ERR compression '" + tokens[2] + "' is not available";
+            } else if(tokens[1] == "FRAME_SIZE") {
+                if(!is_num(tokens[2]) || tokens[2].length() > 9)
+                    response = "ERR frame size must be number";
+                else {
+                    size_t size = std::stoull(tokens[2]);
+                    if(size < ResultStream::min_frame_size || size > ResultStream::max_frame_size)
+                        response = "ERR frame size must be from " + std::to_string(ResultStream::min_frame_size) + " to " + std::to_string(ResultStream::max_frame_size);
+                }
+            } else
+                response = "ERR option may be 'COMPRESSION' or 'FRAME_SIZE' only";
         }
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+        _s._m.update("session.successes."+tokens[1]+"."+name(), 1);
+
+        if(tokens[1] == "COMPRESSION")
+            _s._out.codec(_s._out.compressor().codec(tokens[2]));
+        else
+            _s._out.frame_size(std::stoull(tokens[2]));
 
         return std::move(response);
     }
@@ -372,6 +578,10 @@ public:
         helps.push_back("SYMMETRIC_DIFFERENCE - print records which id present only in one table - 'A' or 'B'\n");
         helps.push_back("DUMP table - print content of table, where table may be 'A' or 'B'\n");
         helps.push_back("REMOVE table id - remove existing record with id from table, where table may be 'A' or 'B' and id must be positive number\n");
+        helps.push_back("REPLICATE - turn connection into replication stream: table snapshot followed by changes, used by followers\n");
+        helps.push_back("REPLICATION - print replication role, applied sequence number and, on follower, lag behind leader\n");
+        helps.push_back("SET COMPRESSION codec - compress DUMP, INTERSECTION and SYMMETRIC_DIFFERENCE rows, where codec may be 'none' or one of: " + boost::algorithm::join(_s._out.compressor().codecs(), ", ") + "; rows are sent as frames 'FRAME codec raw_size packed_size' followed by packed_size bytes\n");
+        helps.push_back("SET FRAME_SIZE size - collect size bytes of rows before compressing them into frame, from " + std::to_string(ResultStream::min_frame_size) + " to " + std::to_string(ResultStream::max_frame_size) + "\n");
         helps.push_back("HELP print this text\n");
 
         boost::system::error_code ec;
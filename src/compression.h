@@ -0,0 +1,287 @@
+#pragma once
+
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <array>
+#include <deque>
+#include <vector>
+#include <map>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "metrics.h"
+
+// Codecs are stateless and shared between worker threads
+class Codec
+{
+public:
+    virtual std::string name() const = 0;
+    virtual bool compress(const std::string& raw, std::string& packed) const = 0;
+    virtual bool decompress(const std::string& packed, size_t raw_size, std::string& raw) const = 0;
+
+    virtual ~Codec() = default;
+};
+
+using Codecs = std::map<std::string, std::unique_ptr<Codec>>;
+
+#ifdef WITH_ZLIB
+class CodecZlib : public Codec
+{
+public:
+    virtual std::string name() const final { return "zlib"; }
+    virtual bool compress(const std::string& raw, std::string& packed) const final {
+        uLongf length = compressBound(raw.length());
+        packed.resize(length);
+        if(compress2(reinterpret_cast<Bytef*>(&packed[0]), &length, reinterpret_cast<const Bytef*>(raw.data()), raw.length(), Z_BEST_SPEED) != Z_OK)
+            return false;
+        packed.resize(length);
+        return true;
+    }
+    virtual bool decompress(const std::string& packed, size_t raw_size, std::string& raw) const final {
+        uLongf length = raw_size;
+        raw.resize(length);
+        if(uncompress(reinterpret_cast<Bytef*>(&raw[0]), &length, reinterpret_cast<const Bytef*>(packed.data()), packed.length()) != Z_OK || length != raw_size)
+            return false;
+        return true;
+    }
+};
+#endif
+
+#ifdef WITH_LZ4
+class CodecLz4 : public Codec
+{
+public:
+    virtual std::string name() const final { return "lz4"; }
+    virtual bool compress(const std::string& raw, std::string& packed) const final {
+        packed.resize(LZ4_compressBound(raw.length()));
+        int length = LZ4_compress_default(raw.data(), &packed[0], raw.length(), packed.length());
+        if(length <= 0)
+            return false;
+        packed.resize(length);
+        return true;
+    }
+    virtual bool decompress(const std::string& packed, size_t raw_size, std::string& raw) const final {
+        raw.resize(raw_size);
+        return LZ4_decompress_safe(packed.data(), &raw[0], packed.length(), raw.length()) == static_cast<int>(raw_size);
+    }
+};
+#endif
+
+#ifdef WITH_ZSTD
+class CodecZstd : public Codec
+{
+public:
+    virtual std::string name() const final { return "zstd"; }
+    virtual bool compress(const std::string& raw, std::string& packed) const final {
+        packed.resize(ZSTD_compressBound(raw.length()));
+        size_t length = ZSTD_compress(&packed[0], packed.length(), raw.data(), raw.length(), 1);
+        if(ZSTD_isError(length))
+            return false;
+        packed.resize(length);
+        return true;
+    }
+    virtual bool decompress(const std::string& packed, size_t raw_size, std::string& raw) const final {
+        raw.resize(raw_size);
+        size_t length = ZSTD_decompress(&raw[0], raw.length(), packed.data(), packed.length());
+        return !ZSTD_isError(length) && length == raw_size;
+    }
+};
+#endif
+
+// Pool of worker threads with own io_service, keeps compression off the main one
+class Compressor
+{
+private:
+    Codecs _codecs;
+
+    boost::asio::io_service _io;
+    std::unique_ptr<boost::asio::io_service::work> _work;
+    std::vector<std::thread> _threads;
+
+    void add_codec(std::unique_ptr<Codec> codec)
+    {
+        _codecs[codec->name()] = std::move(codec);
+    }
+
+public:
+    explicit Compressor(size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+        : _work(new boost::asio::io_service::work(_io))
+    {
+#ifdef WITH_ZLIB
+        add_codec(std::unique_ptr<Codec>(new CodecZlib()));
+#endif
+#ifdef WITH_LZ4
+        add_codec(std::unique_ptr<Codec>(new CodecLz4()));
+#endif
+#ifdef WITH_ZSTD
+        add_codec(std::unique_ptr<Codec>(new CodecZstd()));
+#endif
+
+        for(size_t n = 0; n < threads; ++n)
+            _threads.emplace_back([this]() { _io.run(); });
+    }
+
+    ~Compressor()
+    {
+        _work.reset();
+        for(auto& t : _threads)
+            t.join();
+    }
+
+    const Codec* codec(const std::string& name) const
+    {
+        auto c = _codecs.find(name);
+        return c != _codecs.end() ? c->second.get() : nullptr;
+    }
+
+    std::vector<std::string> codecs() const
+    {
+        std::vector<std::string> names;
+        for(auto& c : _codecs)
+            names.push_back(c.first);
+        return std::move(names);
+    }
+
+    template<typename Job>
+    void post(Job job)
+    {
+        _io.post(job);
+    }
+};
+
+// Result rows of one session. Without codec every row is written as is, with codec rows
+// are collected into frames of frame_size bytes, compressed on Compressor workers and
+// written in order as "FRAME codec raw_size packed_size\n" followed by packed bytes.
+class ResultStream
+{
+private:
+    struct Frame
+    {
+        std::string raw;
+        std::string packed;
+        bool done;
+        bool ok;
+    };
+
+    Metrics& _m;
+    Compressor& _c;
+
+    boost::asio::ip::tcp::socket& _socket;
+    boost::asio::io_service::strand& _strand;
+    boost::asio::steady_timer _timer;
+
+    const Codec* _codec;
+    size_t _frame_size;
+
+    std::string _raw;
+    std::deque<std::shared_ptr<Frame>> _frames;
+
+    void submit()
+    {
+        auto frame = std::make_shared<Frame>();
+        frame->raw.swap(_raw);
+        frame->done = false;
+        frame->ok = false;
+        _frames.push_back(frame);
+
+        const Codec* codec = _codec;
+        boost::asio::io_service::strand& strand = _strand;
+        boost::asio::steady_timer& timer = _timer;
+        _c.post([frame, codec, &strand, &timer]() {
+            frame->ok = codec->compress(frame->raw, frame->packed);
+            strand.post([frame, &timer]() {
+                frame->done = true;
+                timer.cancel();
+            });
+        });
+    }
+
+    // writes compressed frames in order, waits for workers while more than pending frames
+    // are queued; frames are always waited for, even after error, as workers refer to this stream
+    void drain(size_t pending, boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        boost::system::error_code wait_ec;
+        while(!_frames.empty()) {
+            auto frame = _frames.front();
+            if(!frame->done) {
+                if(_frames.size() <= pending)
+                    break;
+                _timer.expires_from_now(std::chrono::seconds(1));
+                _timer.async_wait(yield[wait_ec]);
+                continue;
+            }
+            _frames.pop_front();
+
+            if(ec)
+                continue;
+            if(!frame->ok) {
+                ec = boost::asio::error::invalid_argument;
+                continue;
+            }
+
+            _m.update("session.compression.frames", 1);
+            _m.update("session.compression.raw", frame->raw.length());
+            _m.update("session.compression.packed", frame->packed.length());
+
+            std::string header = "FRAME " + _codec->name() + " " + std::to_string(frame->raw.length()) + " " + std::to_string(frame->packed.length()) + "\n";
+            std::array<boost::asio::const_buffer, 2> buffers = {{
+                boost::asio::buffer(header.c_str(), header.length()),
+                boost::asio::buffer(frame->packed.data(), frame->packed.length())
+            }};
+            boost::asio::async_write(_socket, buffers, yield[ec]);
+        }
+    }
+
+public:
+    static const size_t default_frame_size = 256 * 1024;
+    static const size_t min_frame_size = 1024;
+    static const size_t max_frame_size = 64 * 1024 * 1024;
+    // frames handed to workers before producer waits for writes
+    static const size_t max_pending_frames = 4;
+
+    ResultStream(Metrics& m, Compressor& c, boost::asio::ip::tcp::socket& socket, boost::asio::io_service::strand& strand)
+        : _m(m), _c(c), _socket(socket), _strand(strand), _timer(socket.get_io_service()), _codec(nullptr), _frame_size(default_frame_size)
+    {
+    }
+
+    Compressor& compressor() { return _c; }
+
+    void codec(const Codec* codec) { _codec = codec; }
+    void frame_size(size_t frame_size) { _frame_size = frame_size; }
+
+    void write(const std::string& line, boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        if(!_codec) {
+            boost::asio::async_write(_socket, boost::asio::buffer(line.c_str(), line.length()), yield[ec]);
+            return;
+        }
+
+        _raw += line;
+        if(_raw.length() >= _frame_size) {
+            submit();
+            drain(max_pending_frames, yield, ec);
+        }
+    }
+
+    // must be called after last write, even failed one
+    void flush(boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        if(!_raw.empty() && !ec)
+            submit();
+        _raw.clear();
+        drain(0, yield, ec);
+    }
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <stdexcept>
+#include <vector>
+#include <map>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/tokenizer.hpp>
+
+#include "metrics.h"
+#include "replication.h"
+#include "command.h"
+
+// Keeps local tables in sync with leader: connects, sends REPLICATE and applies
+// the stream. Snapshot is collected aside and swapped in on SYNC, so readers never
+// see half loaded tables. Reconnects after any failure and resyncs from scratch,
+// leader silent for longer than few missed PINGs counts as failure too.
+class Follower
+{
+private:
+    boost::asio::io_service& _io;
+    Metrics& _m;
+    Replication& _r;
+
+    std::map<size_t, std::string>& _a;
+    std::map<size_t, std::string>& _b;
+
+    std::string _host;
+    std::string _port;
+
+    boost::asio::ip::tcp::socket _socket;
+    boost::asio::steady_timer _timer;
+    bool _stopped;
+
+    std::array<char, 8192> _buffer;
+    std::string _data;
+
+    bool _timed_out;
+
+    bool _syncing;
+    std::map<size_t, std::string> _snapshot_a;
+    std::map<size_t, std::string> _snapshot_b;
+
+    // (re)arms deadline of the next connect or read, socket is closed when it passes
+    void deadline()
+    {
+        _timer.expires_from_now(timeout());
+        _timer.async_wait(
+        [this](const boost::system::error_code& ec) {
+            // timer may have been rearmed after this handler was queued
+            if(ec == boost::asio::error::operation_aborted || _timer.expires_at() > std::chrono::steady_clock::now())
+                return;
+            boost::system::error_code close_ec;
+            _timed_out = true;
+            _socket.close(close_ec);
+        });
+    }
+
+    // numbers too big for size_t fail the line as any other malformed one
+    bool apply(size_t start, size_t length)
+    {
+        try {
+            return apply_line(start, length);
+        } catch(std::out_of_range&) {
+            return false;
+        }
+    }
+
+    bool apply_line(size_t start, size_t length)
+    {
+        std::vector<std::string> tokens;
+
+        boost::char_separator<char> sep{" \n"};
+        boost::tokenizer<boost::char_separator<char>> tok{_data.cbegin() + start, _data.cbegin() + start + length, sep};
+        std::copy( tok.begin(), tok.end(), std::back_inserter(tokens) );
+
+        if(tokens.size() < 3 || !is_num(tokens[0]) || !is_num(tokens[1]))
+            return false;
+
+        const std::string& op = tokens[2];
+        if(op == "SNAPSHOT") {
+            _syncing = true;
+            _snapshot_a.clear();
+            _snapshot_b.clear();
+            _r.state("syncing");
+        } else if(op == "SYNC") {
+            if(!_syncing)
+                return false;
+            _syncing = false;
+            _a.swap(_snapshot_a);
+            _b.swap(_snapshot_b);
+            _snapshot_a.clear();
+            _snapshot_b.clear();
+            _r.state("streaming");
+            _m.update("replication.snapshots", 1);
+        } else if(op == "INSERT" || op == "REMOVE" || op == "TRUNCATE") {
+            if(tokens.size() < 4 || (tokens[3] != "A" && tokens[3] != "B"))
+                return false;
+            std::map<size_t, std::string>& r = tokens[3] == "A" ? (_syncing ? _snapshot_a : _a) : (_syncing ? _snapshot_b : _b);
+            if(op == "TRUNCATE")
+                r.clear();
+            else if(tokens.size() < 5 || !is_num(tokens[4]) || (op == "INSERT" && tokens.size() < 6))
+                return false;
+            else if(op == "INSERT")
+                r[std::stoull(tokens[4])] = tokens[5];
+            else
+                r.erase(std::stoull(tokens[4]));
+        } else if(op != "PING")
+            return false;
+
+        // snapshot counts as applied only once it is swapped in
+        if(!_syncing)
+            _r.applied(std::stoull(tokens[0]), std::stoull(tokens[1]));
+        return true;
+    }
+
+    void replicate(boost::asio::yield_context& yield)
+    {
+        boost::system::error_code ec;
+
+        _timed_out = false;
+        deadline();
+
+        boost::asio::ip::tcp::resolver resolver(_io);
+        auto endpoints = resolver.async_resolve(boost::asio::ip::tcp::resolver::query(_host, _port), yield[ec]);
+        if(!ec)
+            boost::asio::async_connect(_socket, endpoints, yield[ec]);
+        if(ec) {
+            _timer.cancel();
+            if(!_stopped)
+                std::cerr << "replication connect error: " << ec << std::endl;
+            return;
+        }
+
+        std::string request = "REPLICATE\n";
+        boost::asio::async_write(_socket, boost::asio::buffer(request.c_str(), request.length()), yield[ec]);
+
+        _data.clear();
+        _syncing = false;
+        while(!ec) {
+            deadline();
+            std::size_t length = _socket.async_read_some(boost::asio::buffer(_buffer.data(), _buffer.size()), yield[ec]);
+            if(ec)
+                break;
+
+            _data.append(_buffer.data(), length);
+
+            size_t start_pos = 0;
+            size_t end_pos;
+            while((end_pos = _data.find('\n', start_pos)) != std::string::npos) {
+                if(_data.compare(start_pos, 2, "OK") == 0 || _data.compare(start_pos, 3, "ERR") == 0) {
+                    std::cerr << "replication stream closed by leader: " << _data.substr(start_pos, end_pos - start_pos) << std::endl;
+                    _timer.cancel();
+                    return;
+                }
+                if(!apply(start_pos, end_pos - start_pos + 1)) {
+                    std::cerr << "replication error: unexpected line '" << _data.substr(start_pos, end_pos - start_pos) << "'" << std::endl;
+                    _timer.cancel();
+                    return;
+                }
+                start_pos = end_pos + 1;
+            }
+            _data.erase(0, start_pos);
+        }
+
+        _timer.cancel();
+        if(_timed_out)
+            std::cerr << "replication error: no data from leader for " << timeout().count() << "s" << std::endl;
+        else if(!_stopped && ec != boost::asio::error::eof)
+            std::cerr << "replication error: " << ec << std::endl;
+    }
+
+public:
+    // leader sends PING every second when idle
+    static std::chrono::seconds timeout() { return std::chrono::seconds(3); }
+
+    Follower(boost::asio::io_service& io, std::map<size_t, std::string>& a, std::map<size_t, std::string>& b, Metrics& m, Replication& r, const std::string& host, const std::string& port)
+        : _io(io),
+          _m(m),
+          _r(r),
+          _a(a),
+          _b(b),
+          _host(host),
+          _port(port),
+          _socket(io),
+          _timer(io),
+          _stopped(false),
+          _timed_out(false),
+          _syncing(false)
+    {
+    }
+
+    void go()
+    {
+        boost::asio::spawn(_io,
+        [this](boost::asio::yield_context yield) {
+            boost::system::error_code ec;
+            while(!_stopped) {
+                _r.state("connecting");
+                replicate(yield);
+                _socket.close(ec);
+                if(_stopped)
+                    break;
+
+                _m.update("replication.disconnects", 1);
+                _r.state("disconnected");
+
+                _timer.expires_from_now(std::chrono::seconds(1));
+                _timer.async_wait(yield[ec]);
+            }
+        });
+    }
+
+    void stop()
+    {
+        boost::system::error_code ec;
+        _stopped = true;
+        _socket.close(ec);
+        _timer.cancel();
+    }
+};
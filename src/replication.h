@@ -0,0 +1,159 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "metrics.h"
+
+size_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// outgoing change stream of one follower connection
+class ReplicationFeed
+{
+public:
+    std::deque<std::string> _queue;
+    boost::asio::steady_timer _timer;
+    bool _overflow;
+
+    explicit ReplicationFeed(boost::asio::io_service& io) : _timer(io), _overflow(false) {}
+};
+
+// Change log shared by all sessions of process.
+// Leader numbers every change and fans it out to subscribed feeds,
+// follower only keeps track of what it has applied from its leader.
+// Every replication line is "seq ms_since_epoch OPERATION args..."
+class Replication
+{
+private:
+    Metrics& _m;
+
+    bool _leader;
+    bool _stopped;
+    size_t _seq;
+    std::list<ReplicationFeed*> _feeds;
+
+    std::string _upstream;
+    std::string _state;
+    size_t _lag;
+    bool _contacted;
+    std::chrono::steady_clock::time_point _contact;
+
+public:
+    // feed is dropped when follower can not keep up, it will resync from snapshot
+    static const size_t max_feed_queue = 1 << 20;
+
+    explicit Replication(Metrics& m)
+        : _m(m), _leader(true), _stopped(false), _seq(0), _lag(0), _contacted(false)
+    {
+    }
+
+    Replication(Metrics& m, const std::string& upstream)
+        : _m(m), _leader(false), _stopped(false), _seq(0), _upstream(upstream), _state("connecting"), _lag(0), _contacted(false)
+    {
+    }
+
+    bool leader() const { return _leader; }
+    bool stopped() const { return _stopped; }
+
+    std::string line(size_t seq, const std::string& change) const
+    {
+        return std::to_string(seq) + " " + std::to_string(now_ms()) + " " + change + "\n";
+    }
+
+    std::string line(const std::string& change) const
+    {
+        return line(_seq, change);
+    }
+
+    void publish(const std::string& change)
+    {
+        if(!_leader)
+            return;
+
+        ++_seq;
+        _m.update("replication.changes", 1);
+
+        if(_feeds.empty())
+            return;
+
+        std::string l = line(_seq, change);
+        for(auto f : _feeds) {
+            if(f->_queue.size() >= max_feed_queue)
+                f->_overflow = true;
+            else
+                f->_queue.push_back(l);
+            f->_timer.cancel();
+        }
+    }
+
+    // returns seq of the last change not queued to feed, snapshot is stamped with it
+    size_t subscribe(ReplicationFeed& feed)
+    {
+        _feeds.push_back(&feed);
+        _m.update("replication.followers", 1);
+        return _seq;
+    }
+
+    void unsubscribe(ReplicationFeed& feed)
+    {
+        _feeds.remove(&feed);
+    }
+
+    // wake up all feeds so they finish and let io_service run out of work
+    void stop()
+    {
+        _stopped = true;
+        for(auto f : _feeds)
+            f->_timer.cancel();
+    }
+
+    void state(const std::string& state)
+    {
+        _state = state;
+    }
+
+    void applied(size_t seq, size_t ms)
+    {
+        size_t now = now_ms();
+        _seq = seq;
+        _lag = now > ms ? now - ms : 0;
+        _contacted = true;
+        _contact = std::chrono::steady_clock::now();
+        _m.update("replication.applied", 1);
+    }
+
+    std::vector<std::string> status() const
+    {
+        std::vector<std::string> lines;
+        if(_leader) {
+            lines.push_back("role leader\n");
+            lines.push_back("seq " + std::to_string(_seq) + "\n");
+            lines.push_back("followers " + std::to_string(_feeds.size()) + "\n");
+        } else {
+            lines.push_back("role follower\n");
+            lines.push_back("leader " + _upstream + "\n");
+            lines.push_back("state " + _state + "\n");
+            lines.push_back("seq " + std::to_string(_seq) + "\n");
+            // lag is only known while changes are flowing, otherwise time since last contact tells how stale tables are
+            if(_contacted && _state == "streaming")
+                lines.push_back("lag_ms " + std::to_string(_lag) + "\n");
+            else
+                lines.push_back("lag_ms unknown\n");
+            if(_contacted) {
+                size_t since = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _contact).count();
+                lines.push_back("last_contact_ms " + std::to_string(since) + "\n");
+            } else
+                lines.push_back("last_contact_ms never\n");
+        }
+        return std::move(lines);
+    }
+};
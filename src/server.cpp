@@ -10,20 +10,32 @@
 #include "../bin/version.h"
 
 #include "session.h"
+#include "follower.h"
 
 int main(int argc, char** argv)
 {
     try {
-        if(argc != 2) {
-            std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+        if(argc != 2 && argc != 4) {
+            std::cerr << "Usage: " << argv[0] << " <port> [<leader host> <leader port>]" << std::endl;
             return 1;
         }
 
         Metrics m;
         std::map<size_t, std::string> a, b;
 
+        Compressor c;
+
         boost::asio::io_service io;
 
+        std::unique_ptr<Replication> r;
+        std::unique_ptr<Follower> f;
+        if(argc == 4) {
+            r.reset(new Replication(m, std::string(argv[2]) + ":" + argv[3]));
+            f.reset(new Follower(io, a, b, m, *r, argv[2], argv[3]));
+            f->go();
+        } else
+            r.reset(new Replication(m));
+
         boost::asio::signal_set sigint(io, SIGINT);
         boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), std::atoi(argv[1])));
 
@@ -31,6 +43,9 @@ int main(int argc, char** argv)
         [&](boost::system::error_code ec, int signal) {
             std::cerr << "finish" << std::endl;
             acceptor.close();
+            r->stop();
+            if(f)
+                f->stop();
         });
 
         boost::asio::spawn(io,
@@ -45,7 +60,7 @@ int main(int argc, char** argv)
                     std::cerr << "accept error: " << ec;
                     break;
                 }
-                std::make_shared<Session>(std::move(socket), a, b, m)->go();
+                std::make_shared<Session>(std::move(socket), a, b, m, *r, c)->go();
             }
         });
 
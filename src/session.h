@@ -13,6 +13,8 @@
 #include <boost/algorithm/string.hpp>
 
 #include "metrics.h"
+#include "replication.h"
+#include "compression.h"
 #include "command.h"
 
 class Session : public std::enable_shared_from_this<Session>
@@ -34,6 +36,7 @@ private:
     bool _echo_cmd;
     bool _local_print_cmd;
 
+    ResultStream _out;
     CommandState _s;
     Commands _commands;
 
@@ -117,7 +120,7 @@ private:
     }
 
 public:
-    explicit Session(boost::asio::ip::tcp::socket socket, std::map<size_t, std::string>& a, std::map<size_t, std::string>& b, Metrics& m)
+    explicit Session(boost::asio::ip::tcp::socket socket, std::map<size_t, std::string>& a, std::map<size_t, std::string>& b, Metrics& m, Replication& r, Compressor& c)
         : _m(m),
           _socket(std::move(socket)),
           _strand(_socket.get_io_service()),
@@ -125,7 +128,8 @@ public:
           _b(b),
           _echo_cmd(false),
           _local_print_cmd(false),
-          _s(m, a, b, _socket, _strand)
+          _out(m, c, _socket, _strand),
+          _s(m, r, a, b, _socket, _strand, _out)
     {
         _m.update("session.count", 1);
 
@@ -135,6 +139,9 @@ public:
         add_command(make_unique<CCSymmetricDifference>(_s));
         add_command(make_unique<CRemove>(_s));
         add_command(make_unique<CDump>(_s));
+        add_command(make_unique<CReplicate>(_s));
+        add_command(make_unique<CReplication>(_s));
+        add_command(make_unique<CSet>(_s));
         add_command(make_unique<CHelp>(_s));
 
         boost::system::error_code ec;
@@ -13,6 +13,9 @@
 
 #include <boost/timer/timer.hpp>
 
+#include "session.h"
+#include "follower.h"
+
 BOOST_AUTO_TEST_SUITE( test_suite )
 
 BOOST_AUTO_TEST_CASE( test_version )
@@ -20,5 +23,427 @@ BOOST_AUTO_TEST_CASE( test_version )
     BOOST_CHECK_GT(build_version(), 0);
 }
 
+// accepts sessions on loopback port until acceptor is closed
+void serve(boost::asio::io_service& io, boost::asio::ip::tcp::acceptor& acceptor, std::map<size_t, std::string>& a, std::map<size_t, std::string>& b, Metrics& m, Replication& r, Compressor& c)
+{
+    acceptor.open(boost::asio::ip::tcp::v4());
+    acceptor.bind(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    acceptor.listen();
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        while(true) {
+            boost::asio::ip::tcp::socket socket(io);
+            acceptor.async_accept(socket, yield[ec]);
+            if(ec)
+                break;
+            std::make_shared<Session>(std::move(socket), a, b, m, r, c)->go();
+        }
+    });
+}
+
+// polls every 10ms, gives up after 5s
+template<typename Predicate>
+bool wait_until(boost::asio::io_service& io, boost::asio::yield_context& yield, Predicate predicate)
+{
+    boost::system::error_code ec;
+    boost::asio::steady_timer timer(io);
+    for(int i = 0; i < 500; ++i) {
+        if(predicate())
+            return true;
+        timer.expires_from_now(std::chrono::milliseconds(10));
+        timer.async_wait(yield[ec]);
+    }
+    return predicate();
+}
+
+class TestClient
+{
+private:
+    boost::asio::ip::tcp::socket _socket;
+    std::array<char, 8192> _buffer;
+    std::string _data;
+
+    bool fill(boost::asio::yield_context& yield)
+    {
+        boost::system::error_code ec;
+        std::size_t length = _socket.async_read_some(boost::asio::buffer(_buffer.data(), _buffer.size()), yield[ec]);
+        if(ec)
+            return false;
+        _data.append(_buffer.data(), length);
+        return true;
+    }
+
+public:
+    explicit TestClient(boost::asio::io_service& io) : _socket(io) {}
+
+    // small buffer keeps long results stuck on server side until they are read
+    void receive_buffer(int size)
+    {
+        _socket.open(boost::asio::ip::tcp::v4());
+        _socket.set_option(boost::asio::socket_base::receive_buffer_size(size));
+    }
+
+    void connect(const boost::asio::ip::tcp::endpoint& endpoint, boost::asio::yield_context& yield)
+    {
+        boost::system::error_code ec;
+        _socket.async_connect(endpoint, yield[ec]);
+    }
+
+    void send(const std::string& request, boost::asio::yield_context& yield)
+    {
+        boost::system::error_code ec;
+        boost::asio::async_write(_socket, boost::asio::buffer(request), yield[ec]);
+    }
+
+    // line without '\n', empty on closed connection
+    std::string line(boost::asio::yield_context& yield)
+    {
+        size_t end_pos;
+        while((end_pos = _data.find('\n')) == std::string::npos)
+            if(!fill(yield))
+                return "";
+        std::string l = _data.substr(0, end_pos);
+        _data.erase(0, end_pos + 1);
+        return std::move(l);
+    }
+
+    std::string bytes(size_t length, boost::asio::yield_context& yield)
+    {
+        while(_data.length() < length)
+            if(!fill(yield))
+                return "";
+        std::string b = _data.substr(0, length);
+        _data.erase(0, length);
+        return std::move(b);
+    }
+
+    // sends command and collects plain output up to response line, which is returned separately
+    std::string request(const std::string& command, std::string& output, boost::asio::yield_context& yield)
+    {
+        send(command + "\n", yield);
+        output.clear();
+        std::string l;
+        while(!(l = line(yield)).empty() && l != "OK" && l.compare(0, 3, "ERR") != 0)
+            output += l + "\n";
+        return std::move(l);
+    }
+
+    void close()
+    {
+        boost::system::error_code ec;
+        _socket.close(ec);
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_replication )
+{
+    Metrics m;
+    std::map<size_t, std::string> la, lb, fa, fb;
+
+    boost::asio::io_service io;
+    Compressor c(1);
+
+    Replication lr(m);
+    boost::asio::ip::tcp::acceptor leader(io);
+    serve(io, leader, la, lb, m, lr, c);
+    std::string port = std::to_string(leader.local_endpoint().port());
+
+    Replication fr(m, "127.0.0.1:" + port);
+    Follower f(io, fa, fb, m, fr, "127.0.0.1", port);
+    boost::asio::ip::tcp::acceptor follower(io);
+    serve(io, follower, fa, fb, m, fr, c);
+
+    auto synced = [&]() { return fa == la && fb == lb; };
+    auto streaming = [&]() {
+        auto status = fr.status();
+        return std::find(status.begin(), status.end(), "state streaming\n") != status.end();
+    };
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        std::string output;
+        TestClient lc(io), fc(io);
+        lc.connect(leader.local_endpoint(), yield);
+        fc.connect(follower.local_endpoint(), yield);
+
+        // first batch goes to snapshot
+        BOOST_CHECK_EQUAL(lc.request("INSERT A 1 a1", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("INSERT A 2 a2", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("INSERT B 2 b2", output, yield), "OK");
+
+        f.go();
+        BOOST_CHECK(wait_until(io, yield, [&]() { return streaming() && synced(); }));
+        BOOST_CHECK_EQUAL(fa.size(), 2u);
+
+        // second one to change stream, follower is already streaming
+        BOOST_CHECK_EQUAL(lc.request("REMOVE B 2", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("INSERT B 3 b3", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("TRUNCATE A", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("INSERT A 4 a4", output, yield), "OK");
+        BOOST_CHECK(wait_until(io, yield, [&]() { return la.count(4) && synced(); }));
+
+        BOOST_CHECK_EQUAL(fc.request("INSERT A 9 a9", output, yield), "ERR read-only follower");
+        BOOST_CHECK_EQUAL(fc.request("REMOVE B 3", output, yield), "ERR read-only follower");
+        BOOST_CHECK_EQUAL(fc.request("TRUNCATE B", output, yield), "ERR read-only follower");
+        BOOST_CHECK_EQUAL(fc.request("REPLICATE", output, yield), "ERR not a leader");
+
+        BOOST_CHECK_EQUAL(fc.request("DUMP A", output, yield), "OK");
+        BOOST_CHECK_EQUAL(output, "4\ta4\n");
+
+        BOOST_CHECK_EQUAL(fc.request("REPLICATION", output, yield), "OK");
+        BOOST_CHECK(output.find("role follower\nleader 127.0.0.1:" + port + "\nstate streaming\nseq 7\nlag_ms ") == 0);
+        size_t lag_pos = output.find("lag_ms ") + 7;
+        BOOST_CHECK(is_num(output.substr(lag_pos, output.find('\n', lag_pos) - lag_pos)));
+        BOOST_CHECK(output.find("\nlast_contact_ms ") != std::string::npos);
+
+        BOOST_CHECK_EQUAL(lc.request("REPLICATION", output, yield), "OK");
+        BOOST_CHECK_EQUAL(output, "role leader\nseq 7\nfollowers 1\n");
+
+        lr.stop();
+        f.stop();
+        leader.close();
+        follower.close();
+        lc.close();
+        fc.close();
+    });
+
+    io.run();
+
+    BOOST_CHECK(fa == la);
+    BOOST_CHECK(fb == lb);
+    BOOST_CHECK_EQUAL(fa.size(), 1u);
+    BOOST_CHECK_EQUAL(fa[4], "a4");
+    BOOST_CHECK_EQUAL(fb.size(), 1u);
+    BOOST_CHECK_EQUAL(fb[3], "b3");
+}
+
+BOOST_AUTO_TEST_CASE( test_follower_silent_leader )
+{
+    Metrics m;
+    std::map<size_t, std::string> fa, fb;
+
+    boost::asio::io_service io;
+
+    // leader that sends empty snapshot and then never says anything
+    boost::asio::ip::tcp::acceptor leader(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    std::string port = std::to_string(leader.local_endpoint().port());
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> accepted;
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        while(true) {
+            std::unique_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(io));
+            leader.async_accept(*socket, yield[ec]);
+            if(ec)
+                break;
+            std::string snapshot = "0 " + std::to_string(now_ms()) + " SNAPSHOT\n0 " + std::to_string(now_ms()) + " SYNC\n";
+            boost::asio::async_write(*socket, boost::asio::buffer(snapshot), yield[ec]);
+            accepted.push_back(std::move(socket));
+        }
+    });
+
+    Replication fr(m, "127.0.0.1:" + port);
+    Follower f(io, fa, fb, m, fr, "127.0.0.1", port);
+
+    auto has = [&](const std::string& line) {
+        auto status = fr.status();
+        return std::find(status.begin(), status.end(), line) != status.end();
+    };
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        f.go();
+        BOOST_CHECK(wait_until(io, yield, [&]() { return has("state streaming\n"); }));
+        BOOST_CHECK(!has("lag_ms unknown\n"));
+
+        BOOST_CHECK(wait_until(io, yield, [&]() { return !has("state streaming\n"); }));
+        BOOST_CHECK(has("lag_ms unknown\n"));
+
+        BOOST_CHECK(wait_until(io, yield, [&]() { return accepted.size() == 2 && has("state streaming\n"); }));
+
+        f.stop();
+        leader.close();
+        accepted.clear();
+    });
+
+    io.run();
+}
+
+BOOST_AUTO_TEST_CASE( test_follower_read_during_truncate )
+{
+    Metrics m;
+    std::map<size_t, std::string> la, lb, fa, fb;
+    const size_t count = 100000;
+    for(size_t id = 0; id < count; ++id) {
+        la[id] = std::string(64, 'a');
+        lb[id] = std::string(64, 'b');
+    }
+
+    boost::asio::io_service io;
+    Compressor c(1);
+
+    Replication lr(m);
+    boost::asio::ip::tcp::acceptor leader(io);
+    serve(io, leader, la, lb, m, lr, c);
+    std::string port = std::to_string(leader.local_endpoint().port());
+
+    Replication fr(m, "127.0.0.1:" + port);
+    Follower f(io, fa, fb, m, fr, "127.0.0.1", port);
+    boost::asio::ip::tcp::acceptor follower(io);
+    serve(io, follower, fa, fb, m, fr, c);
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        std::string output;
+        TestClient lc(io), dump(io), cross(io), status(io);
+        dump.receive_buffer(2048);
+        cross.receive_buffer(2048);
+        lc.connect(leader.local_endpoint(), yield);
+        dump.connect(follower.local_endpoint(), yield);
+        cross.connect(follower.local_endpoint(), yield);
+        status.connect(follower.local_endpoint(), yield);
+
+        f.go();
+        BOOST_CHECK(wait_until(io, yield, [&]() { return fa.size() == la.size() && fb.size() == lb.size(); }));
+
+        // both results stall on full socket buffers, while tables are truncated under them
+        dump.send("DUMP A\n", yield);
+        cross.send("INTERSECTION\n", yield);
+        BOOST_CHECK_EQUAL(dump.line(yield), "0\t" + std::string(64, 'a'));
+        BOOST_CHECK_EQUAL(cross.line(yield), "0\t" + std::string(64, 'a') + "\t0\t" + std::string(64, 'b'));
+
+        BOOST_CHECK_EQUAL(lc.request("TRUNCATE A", output, yield), "OK");
+        BOOST_CHECK_EQUAL(lc.request("TRUNCATE B", output, yield), "OK");
+        BOOST_CHECK(wait_until(io, yield, [&]() { return fa.empty() && fb.empty(); }));
+
+        size_t rows = 1;
+        std::string l;
+        while(!(l = dump.line(yield)).empty() && l != "OK")
+            ++rows;
+        BOOST_CHECK_EQUAL(l, "OK");
+        BOOST_CHECK_LT(rows, count);
+
+        rows = 1;
+        while(!(l = cross.line(yield)).empty() && l != "OK")
+            ++rows;
+        BOOST_CHECK_EQUAL(l, "OK");
+        BOOST_CHECK_LT(rows, count);
+
+        BOOST_CHECK_EQUAL(status.request("REPLICATION", output, yield), "OK");
+        BOOST_CHECK(output.find("state streaming\n") != std::string::npos);
+
+        lr.stop();
+        f.stop();
+        leader.close();
+        follower.close();
+        lc.close();
+        dump.close();
+        cross.close();
+        status.close();
+    });
+
+    io.run();
+}
+
+BOOST_AUTO_TEST_CASE( test_compressed_results )
+{
+    Metrics m;
+    std::map<size_t, std::string> a, b;
+    for(size_t id = 0; id < 5000; ++id)
+        a[id] = "description" + std::to_string(id % 10);
+
+    boost::asio::io_service io;
+    Compressor c(2);
+    Replication r(m);
+
+    boost::asio::ip::tcp::acceptor acceptor(io);
+    serve(io, acceptor, a, b, m, r, c);
+
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        std::string plain, output;
+        TestClient client(io);
+        client.connect(acceptor.local_endpoint(), yield);
+
+        BOOST_CHECK_EQUAL(client.request("DUMP A", plain, yield), "OK");
+        BOOST_CHECK_EQUAL(std::count(plain.begin(), plain.end(), '\n'), 5000);
+
+        BOOST_CHECK_EQUAL(client.request("SET COMPRESSION brotli", output, yield), "ERR compression 'brotli' is not available");
+        BOOST_CHECK_EQUAL(client.request("SET FRAME_SIZE 10", output, yield), "ERR frame size must be from 1024 to 67108864");
+        BOOST_CHECK_EQUAL(client.request("SET FRAME_SIZE big", output, yield), "ERR frame size must be number");
+        BOOST_CHECK_EQUAL(client.request("SET LEVEL 1", output, yield), "ERR option may be 'COMPRESSION' or 'FRAME_SIZE' only");
+        BOOST_CHECK_EQUAL(client.request("SET COMPRESSION", output, yield), "ERR not enough arguments for set");
+
+        // rejected options leave session uncompressed
+        BOOST_CHECK_EQUAL(client.request("DUMP A", output, yield), "OK");
+        BOOST_CHECK(output == plain);
+
+        BOOST_CHECK(!c.codecs().empty());
+        for(auto& name : c.codecs()) {
+            BOOST_TEST_MESSAGE("checking " + name + " result stream");
+            const Codec* codec = c.codec(name);
+            BOOST_CHECK_EQUAL(client.request("SET COMPRESSION " + boost::to_upper_copy(name), output, yield), "OK");
+            BOOST_CHECK_EQUAL(client.request("SET FRAME_SIZE 1024", output, yield), "OK");
+
+            client.send("DUMP A\n", yield);
+            std::string rows, l;
+            size_t frames = 0, short_frames = 0;
+            while((l = client.line(yield)).compare(0, 6, "FRAME ") == 0) {
+                std::vector<std::string> header;
+                boost::split(header, l, boost::is_any_of(" "));
+                BOOST_REQUIRE_EQUAL(header.size(), 4u);
+                BOOST_CHECK_EQUAL(header[1], name);
+                size_t raw_size = std::stoull(header[2]);
+                if(raw_size < 1024)
+                    ++short_frames;
+
+                std::string raw;
+                BOOST_REQUIRE(codec->decompress(client.bytes(std::stoull(header[3]), yield), raw_size, raw));
+                rows += raw;
+                ++frames;
+            }
+            BOOST_CHECK_EQUAL(l, "OK");
+            // only the flushed tail may be shorter than frame size
+            BOOST_CHECK_LE(short_frames, 1u);
+            size_t pending = ResultStream::max_pending_frames;
+            BOOST_CHECK_GT(frames, pending);
+            BOOST_CHECK(rows == plain);
+
+            BOOST_CHECK_EQUAL(client.request("SET COMPRESSION none", output, yield), "OK");
+            BOOST_CHECK_EQUAL(client.request("DUMP A", output, yield), "OK");
+            BOOST_CHECK(output == plain);
+        }
+
+        r.stop();
+        acceptor.close();
+        client.close();
+    });
+
+    io.run();
+}
+
+BOOST_AUTO_TEST_CASE( test_codecs )
+{
+    Compressor c(1);
+
+    std::string raw;
+    for(size_t id = 0; id < 10000; ++id)
+        raw += std::to_string(id) + "\tdescription" + std::to_string(id % 10) + "\n";
+
+    for(auto& name : c.codecs()) {
+        const Codec* codec = c.codec(name);
+        std::string packed, unpacked;
+        BOOST_CHECK(codec->compress(raw, packed));
+        BOOST_CHECK_LT(packed.length(), raw.length());
+        BOOST_CHECK(codec->decompress(packed, raw.length(), unpacked));
+        BOOST_CHECK(unpacked == raw);
+    }
+
+    BOOST_CHECK(c.codec("none") == nullptr);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 